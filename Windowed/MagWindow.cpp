@@ -17,6 +17,7 @@
 
 #include "stdafx.h"
 #include "resource1.h"
+#include "PostProcess.h"
 
 // Ensure that the following definition is in effect before winuser.h is included.
 #ifndef _WIN32_WINNT
@@ -25,6 +26,11 @@
 
 #define RESTOREDWINDOWSTYLES WS_SIZEBOX | WS_SYSMENU | WS_CLIPCHILDREN | WS_CAPTION
 
+// Missing from SDKs older than 10.0.19041
+#ifndef WDA_EXCLUDEFROMCAPTURE
+#define WDA_EXCLUDEFROMCAPTURE 0x00000011
+#endif
+
 // Global variables and strings.
 float				magFactor = 2.0f;
 HINSTANCE           hInst;
@@ -61,6 +67,8 @@ HWND hDlgCurrent = NULL;
 
 #define ID_MENU 161
 
+#define ID_STATUS 171
+
 #define INPUT_Y 23
 #define INPUT_X 50
 
@@ -68,9 +76,25 @@ HWND hDlgCurrent = NULL;
 struct preset {
 	std::string name = "";
 	float rf = 1, gf = 1, bf = 1, ro = 0, go = 0, bo = 0, zoom = 2;
+	postSettings post;
 };
 std::vector<preset> presets;
 
+// Post-processing. When a preset enables a stage, the magnifier control is hidden and the
+// host window draws the processed image itself.
+struct dibBuffer {
+	HDC dc = NULL;
+	HBITMAP bitmap = NULL;
+	HGDIOBJ oldBitmap = NULL;
+	uint8_t* bits = NULL;
+	int width = 0, height = 0;
+};
+postSettings activePost;
+colorFilter activeColor;
+bool postActive = false;
+dibBuffer captureBuffer;	// unmagnified source rectangle, grabbed from the screen
+dibBuffer frameBuffer;		// processed image drawn into the host window
+
 
 // Forward declarations.
 ATOM                RegisterHostWindowClass(HINSTANCE hInstance);
@@ -80,6 +104,9 @@ void CALLBACK       UpdateMagWindow(HWND hwnd, UINT uMsg, UINT_PTR idEvent, DWOR
 void SetupToolbarWindow(HINSTANCE hInstance);
 BOOL                isMouseTransparent = FALSE;
 bool updateMagColors(float rf, float gf, float bf, float ro, float bo, float go);
+bool updatePostProcess(const postSettings& post);
+void drawPostFrame(RECT sourceRect);
+void freeDib(dibBuffer& buf);
 void loadSettings(char filename[MAX_PATH]);
 
 //
@@ -128,6 +155,8 @@ int APIENTRY WinMain(_In_ HINSTANCE hInstance,
 
     // Shut down.
     KillTimer(NULL, timerId);
+	freeDib(captureBuffer);
+	freeDib(frameBuffer);
     MagUninitialize();
     return (int) msg.wParam;
 }
@@ -183,6 +212,24 @@ LRESULT CALLBACK HostWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lPar
         PostQuitMessage(0);
         break;
 
+	case WM_ERASEBKGND:
+		if (postActive)
+		{
+			return 1; // the frame covers the whole client area
+		}
+		return DefWindowProc(hWnd, message, wParam, lParam);
+
+	case WM_PAINT:
+		if (postActive)
+		{
+			PAINTSTRUCT ps;
+			HDC hdc = BeginPaint(hWnd, &ps);
+			BitBlt(hdc, 0, 0, frameBuffer.width, frameBuffer.height, frameBuffer.dc, 0, 0, SRCCOPY);
+			EndPaint(hWnd, &ps);
+			break;
+		}
+		return DefWindowProc(hWnd, message, wParam, lParam);
+
     case WM_SIZE:
         if ( hwndMag != NULL )
         {
@@ -277,6 +324,8 @@ LRESULT CALLBACK ToolbarWndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM l
 				(LPARAM)(p.zoom * 2.0f)
 			);
 			changeMag(hWnd, TB_ENDTRACK);
+			SetDlgItemText(hWnd, ID_STATUS,
+				updatePostProcess(p.post) ? "" : "Image filters need Windows 10 2004+");
 			
 		} else if (HIWORD(wParam) == EN_CHANGE) {
 			for (idx = 0; idx < 6; idx++) {
@@ -350,6 +399,20 @@ void loadSettings(char filename[MAX_PATH]) {
 			p.bo = stof(token);
 			std::getline(iss, token, ',');
 			p.zoom = stof(token);
+			// Optional post-processing columns; older files without them leave the stages off
+			if (std::getline(iss, token, ',')) {
+				p.post.sharpen = stof(token);
+			}
+			if (std::getline(iss, token, ',')) {
+				p.post.contrast = stof(token);
+			}
+			if (std::getline(iss, token, ',')) {
+				p.post.posterize = (int)std::lround(stof(token));
+			}
+			if (std::getline(iss, token, ',')) {
+				p.post.outline = (int)std::lround(stof(token));
+			}
+			clampPostSettings(p.post);
 			presets.push_back(p);
 		}
 	}
@@ -388,7 +451,7 @@ void SetupToolbarWindow(HINSTANCE hInstance)
 		"toolbar",
 		"Toolbar",
 		RESTOREDWINDOWSTYLES,
-		50, GetSystemMetrics(SM_CYSCREEN) - 450, 120, 360, //GetSystemMetrics(SM_CYSCREEN),
+		50, GetSystemMetrics(SM_CYSCREEN) - 450, 120, 390, //GetSystemMetrics(SM_CYSCREEN),
 		NULL, NULL, hInstance, NULL
 	);
 
@@ -438,6 +501,9 @@ void SetupToolbarWindow(HINSTANCE hInstance)
 
 	CreateWindowEx(0, WC_COMBOBOX, "(Presets)", WS_TABSTOP | CBS_DROPDOWNLIST | CBS_HASSTRINGS | WS_CHILD | WS_VISIBLE,
 		5, 285, 105, INPUT_Y, hwndFilter, (HMENU)ID_MENU, GetModuleHandle(NULL), NULL);
+
+	CreateWindowEx(0, "STATIC", "", WS_CHILD | WS_VISIBLE | SS_LEFT,
+		5, 315, 105, 30, hwndFilter, (HMENU)ID_STATUS, GetModuleHandle(NULL), NULL);
 	
 }
 
@@ -455,9 +521,190 @@ bool updateMagColors(float rf, float gf, float bf, float ro, float bo, float go)
 		{ 0.0f,  0.0f,  0.0f,  1.0f,  0.0f },
 		{ ro,  bo,  go,  0.0f,  1.0f }
 	} };
+	// Same values for the post-processing path, which the color effect doesn't reach
+	activeColor.factor[0] = rf;
+	activeColor.factor[1] = gf;
+	activeColor.factor[2] = bf;
+	activeColor.offset[0] = ro;
+	activeColor.offset[1] = bo;
+	activeColor.offset[2] = go;
 	return MagSetColorEffect(hwndMag, &magEffectInvert);
 }
 
+//
+// FUNCTION: resizeDib
+//
+// PURPOSE: Makes sure a buffer holds a top-down 32bpp BGRA bitmap of the given size.
+//
+bool resizeDib(dibBuffer& buf, int width, int height) {
+	if (buf.bitmap && buf.width == width && buf.height == height)
+	{
+		return true;
+	}
+	freeDib(buf);
+
+	BITMAPINFO bmi = {};
+	bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+	bmi.bmiHeader.biWidth = width;
+	bmi.bmiHeader.biHeight = -height; // top-down
+	bmi.bmiHeader.biPlanes = 1;
+	bmi.bmiHeader.biBitCount = 32;
+	bmi.bmiHeader.biCompression = BI_RGB;
+
+	void* bits = NULL;
+	buf.dc = CreateCompatibleDC(NULL);
+	buf.bitmap = CreateDIBSection(buf.dc, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+	if (!buf.dc || !buf.bitmap)
+	{
+		freeDib(buf);
+		return false;
+	}
+	buf.oldBitmap = SelectObject(buf.dc, buf.bitmap);
+	buf.bits = (uint8_t*)bits;
+	buf.width = width;
+	buf.height = height;
+	return true;
+}
+
+void freeDib(dibBuffer& buf) {
+	if (buf.dc)
+	{
+		if (buf.oldBitmap)
+		{
+			SelectObject(buf.dc, buf.oldBitmap);
+		}
+		DeleteDC(buf.dc);
+	}
+	if (buf.bitmap)
+	{
+		DeleteObject(buf.bitmap);
+	}
+	buf = dibBuffer();
+}
+
+//
+// FUNCTION: drawCursor
+//
+// PURPOSE: Draws the mouse cursor into the processed frame, since screen captures leave it out.
+//
+void drawCursor(HDC hdc, RECT sourceRect) {
+	CURSORINFO ci = {};
+	ci.cbSize = sizeof(ci);
+	if (!GetCursorInfo(&ci) || !(ci.flags & CURSOR_SHOWING))
+	{
+		return;
+	}
+	ICONINFO ii;
+	if (!GetIconInfo(ci.hCursor, &ii))
+	{
+		return;
+	}
+	int x = (int)((ci.ptScreenPos.x - sourceRect.left - (int)ii.xHotspot) * magFactor);
+	int y = (int)((ci.ptScreenPos.y - sourceRect.top - (int)ii.yHotspot) * magFactor);
+	int size = (int)(GetSystemMetrics(SM_CXCURSOR) * magFactor);
+	DrawIconEx(hdc, x, y, ci.hCursor, size, size, 0, NULL, DI_NORMAL);
+	if (ii.hbmMask)
+	{
+		DeleteObject(ii.hbmMask);
+	}
+	if (ii.hbmColor)
+	{
+		DeleteObject(ii.hbmColor);
+	}
+}
+
+//
+// FUNCTION: drawPostFrame
+//
+// PURPOSE: Captures the source rectangle from the screen, runs the post-processing stages on it
+// and queues the result to be painted into the host window.
+//
+void drawPostFrame(RECT sourceRect) {
+	int srcWidth = sourceRect.right - sourceRect.left;
+	int srcHeight = sourceRect.bottom - sourceRect.top;
+	int width = magWindowRect.right - magWindowRect.left;
+	int height = magWindowRect.bottom - magWindowRect.top;
+	if (srcWidth <= 0 || srcHeight <= 0 || width <= 0 || height <= 0 ||
+		!resizeDib(captureBuffer, srcWidth, srcHeight) || !resizeDib(frameBuffer, width, height))
+	{
+		return;
+	}
+
+	// The host window is excluded from capture, so this doesn't see its own output
+	HDC screen = GetDC(NULL);
+	BitBlt(captureBuffer.dc, 0, 0, srcWidth, srcHeight, screen, sourceRect.left, sourceRect.top, SRCCOPY | CAPTUREBLT);
+	ReleaseDC(NULL, screen);
+	GdiFlush();
+
+	postProcessFrame(activePost, activeColor,
+		captureBuffer.bits, srcWidth, srcHeight, srcWidth * 4,
+		frameBuffer.bits, width, height, width * 4);
+	drawCursor(frameBuffer.dc, sourceRect);
+
+	InvalidateRect(hwndHost, NULL, FALSE);
+}
+
+//
+// FUNCTION: supportsCaptureExclusion
+//
+// PURPOSE: Checks for Windows 10 version 2004 (build 19041) or later, the first version where
+// WDA_EXCLUDEFROMCAPTURE keeps a window out of screen captures. RtlGetVersion is used since
+// GetVersionEx reports the version from the manifest rather than the real one.
+//
+bool supportsCaptureExclusion() {
+	typedef LONG (WINAPI *RtlGetVersionProc)(PRTL_OSVERSIONINFOW);
+	HMODULE ntdll = GetModuleHandle(TEXT("ntdll.dll"));
+	if (!ntdll)
+	{
+		return false;
+	}
+	RtlGetVersionProc rtlGetVersion = (RtlGetVersionProc)GetProcAddress(ntdll, "RtlGetVersion");
+	if (!rtlGetVersion)
+	{
+		return false;
+	}
+	RTL_OSVERSIONINFOW info = {};
+	info.dwOSVersionInfoSize = sizeof(info);
+	if (rtlGetVersion(&info) != 0)
+	{
+		return false;
+	}
+	return info.dwMajorVersion > 10 || (info.dwMajorVersion == 10 && info.dwBuildNumber >= 19041);
+}
+
+//
+// FUNCTION: updatePostProcess
+//
+// PURPOSE: Switches between the magnifier control and drawing the processed image ourselves.
+// Returns false if the preset's stages can't run on this system.
+//
+bool updatePostProcess(const postSettings& post) {
+	activePost = post;
+	resetContrast();
+
+	// Capturing the screen under our own window needs WDA_EXCLUDEFROMCAPTURE. Older versions
+	// accept it but behave as WDA_MONITOR, which would capture a black box, so support is
+	// decided from the OS build. Reading the affinity back only catches outright failures.
+	bool wanted = postProcessEnabled(post) && supportsCaptureExclusion();
+	DWORD affinity = WDA_NONE;
+	SetWindowDisplayAffinity(hwndHost, wanted ? WDA_EXCLUDEFROMCAPTURE : WDA_NONE);
+	GetWindowDisplayAffinity(hwndHost, &affinity);
+	if (wanted && affinity != WDA_EXCLUDEFROMCAPTURE)
+	{
+		SetWindowDisplayAffinity(hwndHost, WDA_NONE);
+	}
+	postActive = wanted && affinity == WDA_EXCLUDEFROMCAPTURE;
+
+	ShowWindow(hwndMag, postActive ? SW_HIDE : SW_SHOW);
+	if (!postActive)
+	{
+		freeDib(captureBuffer);
+		freeDib(frameBuffer);
+	}
+	InvalidateRect(hwndHost, NULL, TRUE);
+	return postActive || !postProcessEnabled(post);
+}
+
 //
 // FUNCTION: SetupMagnifier
 //
@@ -550,13 +797,23 @@ void CALLBACK UpdateMagWindow(HWND /*hwnd*/, UINT /*uMsg*/, UINT_PTR /*idEvent*/
     sourceRect.right = sourceRect.left + srcWidth;
     sourceRect.bottom = sourceRect.top + srcHeight;
 
-    // Set the source rectangle for the magnifier control.
-    MagSetWindowSource(hwndMag, sourceRect);
+    // Set the source rectangle for the magnifier control, or draw it ourselves when post-processing.
+	if (postActive)
+	{
+		drawPostFrame(sourceRect);
+	}
+	else
+	{
+		MagSetWindowSource(hwndMag, sourceRect);
+	}
 
     // Reclaim topmost status, to prevent unmagnified menus from remaining in view. 
     SetWindowPos(hwndHost, HWND_TOPMOST, 0, 0, 0, 0, 
         SWP_NOACTIVATE | SWP_NOMOVE | SWP_NOSIZE );
 
     // Force redraw.
-    InvalidateRect(hwndMag, NULL, TRUE);
+	if (!postActive)
+	{
+		InvalidateRect(hwndMag, NULL, TRUE);
+	}
 }
@@ -0,0 +1,316 @@
+/*************************************************************************************************
+*
+* File: PostProcess.cpp
+*
+* Description: Scales a captured screen image and runs the low vision stages from
+* PostProcess.h over it.
+*
+*************************************************************************************************/
+
+#include "PostProcess.h"
+
+#include <stddef.h>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#define MIN_CONTRAST_RANGE 32	// limits the stretch to 8x so flat areas don't turn to noise
+#define CONTRAST_SMOOTHING 0.2f	// how fast the stretch follows changes in the image
+#define ROW_PADDING 6			// one pixel left of each row, five right of it
+
+// Row buffers, kept between frames to avoid reallocating. Row y of a pass lives in [y % 3].
+static std::vector<uint32_t> scaledRows[3];
+static std::vector<uint32_t> thickRows[3];
+
+// Bilinear sampling positions for each destination column
+static std::vector<int> columnLeft, columnRight;
+static std::vector<int16_t> columnWeights;	// 8 per column: 256 - w for the left pixel, w for the right
+
+// Smoothed contrast bounds per channel (BGR), so the stretch doesn't flicker as the view moves
+static float contrastLow[3] = { 0, 0, 0 };
+static float contrastHigh[3] = { 255, 255, 255 };
+static bool contrastMeasured = false;
+
+bool postProcessEnabled(const postSettings& s) {
+	return s.sharpen > 0 || s.contrast > 0 || s.posterize >= 2 || s.outline != 0;
+}
+
+void clampPostSettings(postSettings& s) {
+	s.sharpen = std::min(std::max(s.sharpen, 0.0f), 7.9f);
+	s.contrast = std::min(std::max(s.contrast, 0.0f), 1.0f);
+	if (s.posterize != 0) {
+		s.posterize = std::min(std::max(s.posterize, 2), 8);
+	}
+	if (s.outline != 0) {
+		s.outline = s.outline > 0 ? 1 : -1;
+	}
+}
+
+void resetContrast() {
+	contrastMeasured = false;
+}
+
+//
+// Chain selection. Each step adds its stage to the type list if enabled, so every
+// combination of stages gets its own fused instantiation of filterChain.
+//
+
+template <typename... Stages>
+static rowFilter selectPosterize(const postSettings& s) {
+	if (s.posterize >= 2) {
+		return &filterChain<Stages..., posterizeStage, colorStage>::run;
+	}
+	return &filterChain<Stages..., colorStage>::run;
+}
+
+template <typename... Stages>
+static rowFilter selectContrast(const postSettings& s) {
+	if (s.contrast > 0) {
+		return selectPosterize<Stages..., contrastStage>(s);
+	}
+	return selectPosterize<Stages...>(s);
+}
+
+static rowFilter selectChain(const postSettings& s) {
+	if (s.sharpen > 0) {
+		return selectContrast<sharpenStage>(s);
+	}
+	return selectContrast<>(s);
+}
+
+// Thickening runs as a separate pass so the fused stages see its result
+static rowFilter selectThicken(const postSettings& s) {
+	if (s.outline > 0) {
+		return &filterChain<thickenDarkStage>::run;
+	}
+	else if (s.outline < 0) {
+		return &filterChain<thickenLightStage>::run;
+	}
+	return NULL;
+}
+
+//
+// FUNCTION: measureContrast
+//
+// PURPOSE: Updates the smoothed per-channel bounds used by the contrast stretch.
+//
+static void measureContrast(const uint8_t* src, int width, int height, int stride, float strength) {
+	__m128i lowAcc = _mm_set1_epi8(-1);
+	__m128i highAcc = _mm_setzero_si128();
+	uint8_t low[16], high[16];
+
+	for (int y = 0; y < height; y++) {
+		const uint8_t* row = src + (size_t)y * stride;
+		int x = 0;
+		for (; x + 4 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(row + x * 4));
+			lowAcc = _mm_min_epu8(lowAcc, v);
+			highAcc = _mm_max_epu8(highAcc, v);
+		}
+		for (; x < width; x++) {
+			// Fold the leftover pixels into the first lane
+			__m128i v = _mm_cvtsi32_si128(*(const int*)(row + x * 4));
+			lowAcc = _mm_min_epu8(lowAcc, _mm_or_si128(v, _mm_set_epi32(-1, -1, -1, 0)));
+			highAcc = _mm_max_epu8(highAcc, v);
+		}
+	}
+	_mm_storeu_si128((__m128i*)low, lowAcc);
+	_mm_storeu_si128((__m128i*)high, highAcc);
+
+	for (int c = 0; c < 3; c++) {
+		int lo = std::min(std::min(low[c], low[c + 4]), std::min(low[c + 8], low[c + 12]));
+		int hi = std::max(std::max(high[c], high[c + 4]), std::max(high[c + 8], high[c + 12]));
+		// Strength moves the bounds from the full range toward the measured range
+		float targetLow = lo * strength;
+		float targetHigh = 255 - (255 - hi) * strength;
+		if (contrastMeasured) {
+			contrastLow[c] += (targetLow - contrastLow[c]) * CONTRAST_SMOOTHING;
+			contrastHigh[c] += (targetHigh - contrastHigh[c]) * CONTRAST_SMOOTHING;
+		}
+		else {
+			contrastLow[c] = targetLow;
+			contrastHigh[c] = targetHigh;
+		}
+	}
+	contrastMeasured = true;
+}
+
+//
+// FUNCTION: makeParams
+//
+// PURPOSE: Builds the per-frame stage constants from the preset and color filter.
+//
+static stageParams makeParams(const postSettings& s, const colorFilter& color) {
+	stageParams p;
+	p.colorMask = _mm_setr_epi16(-1, -1, -1, 0, -1, -1, -1, 0);
+
+	short amount = (short)(std::min(std::max(s.sharpen, 0.0f), 7.9f) * 4096);
+	p.sharpen = _mm_setr_epi16(amount, amount, amount, 0, amount, amount, amount, 0);
+
+	short low[3], scale[3];
+	for (int c = 0; c < 3; c++) {
+		float lo = contrastLow[c];
+		float range = std::max(contrastHigh[c] - lo, (float)MIN_CONTRAST_RANGE);
+		lo = std::min(lo, 255 - range);
+		// Round the low bound down and the scale up so the top of the range reaches 255;
+		// contrastStage clamps any overshoot
+		low[c] = (short)lo;
+		scale[c] = (short)std::ceil(255 * 512 / range);
+	}
+	p.contrastLow = _mm_setr_epi16(low[0], low[1], low[2], 0, low[0], low[1], low[2], 0);
+	p.contrastScale = _mm_setr_epi16(scale[0], scale[1], scale[2], 512, scale[0], scale[1], scale[2], 512);
+
+	// Alpha uses 256 levels and an index scale of 1, which leaves it unchanged
+	short levels = (short)(std::min(std::max(s.posterize, 2), 8) - 1);
+	short recip = (short)(32768 / levels);
+	short alphaRecip = (short)-32768;	// 32768 as an unsigned lane
+	p.levels = _mm_setr_epi16(levels, levels, levels, 255, levels, levels, levels, 255);
+	p.levelScale = _mm_setr_epi16(510, 510, 510, 2, 510, 510, 510, 2);
+	p.levelRecip = _mm_setr_epi16(recip, recip, recip, alphaRecip, recip, recip, recip, alphaRecip);
+
+	// Pixels are BGRA, the filter is RGB
+	short factor[3], offset[3];
+	for (int c = 0; c < 3; c++) {
+		factor[c] = (short)std::lround(std::min(std::max(color.factor[2 - c], -31.0f), 31.0f) * 1024);
+		offset[c] = (short)std::lround(std::min(std::max(color.offset[2 - c], -31.0f), 31.0f) * 255);
+	}
+	p.factor = _mm_setr_epi16(factor[0], factor[1], factor[2], 1024, factor[0], factor[1], factor[2], 1024);
+	p.offset = _mm_setr_epi16(offset[0], offset[1], offset[2], 0, offset[0], offset[1], offset[2], 0);
+	return p;
+}
+
+//
+// FUNCTION: mapColumns
+//
+// PURPOSE: Works out which two source pixels, and with what weights, each destination column
+// blends. Pixel centers are aligned so the image doesn't shift as the zoom changes.
+//
+static void mapColumns(int srcWidth, int destWidth) {
+	columnLeft.resize(destWidth);
+	columnRight.resize(destWidth);
+	columnWeights.resize(destWidth * 8);
+	for (int x = 0; x < destWidth; x++) {
+		int64_t pos = ((int64_t)(2 * x + 1) * srcWidth * 256) / (2 * destWidth) - 128;
+		pos = std::max(pos, (int64_t)0);
+		int left = (int)(pos >> 8);
+		int w = (int)(pos & 255);
+		if (left >= srcWidth - 1) {
+			left = srcWidth - 1;
+			w = 0;
+		}
+		columnLeft[x] = left;
+		columnRight[x] = std::min(left + 1, srcWidth - 1);
+		for (int c = 0; c < 4; c++) {
+			columnWeights[x * 8 + c] = (int16_t)(256 - w);
+			columnWeights[x * 8 + 4 + c] = (int16_t)w;
+		}
+	}
+}
+
+//
+// FUNCTION: padRow
+//
+// PURPOSE: Repeats the edge pixels of a row into its padding.
+//
+static void padRow(uint32_t* padded, int width) {
+	uint32_t* row = padded + 1;
+	padded[0] = row[0];
+	for (int x = width; x < width + ROW_PADDING - 1; x++) {
+		row[x] = row[width - 1];
+	}
+}
+
+//
+// FUNCTION: scaleRow
+//
+// PURPOSE: Bilinear scales destination row y out of the source image into a padded row buffer.
+//
+static void scaleRow(const uint8_t* src, int srcHeight, int srcStride, int y, int destHeight,
+	uint32_t* padded, int width)
+{
+	int64_t pos = ((int64_t)(2 * y + 1) * srcHeight * 256) / (2 * destHeight) - 128;
+	pos = std::max(pos, (int64_t)0);
+	int top = std::min((int)(pos >> 8), srcHeight - 1);
+	int wy = top == srcHeight - 1 ? 0 : (int)(pos & 255);
+	const uint32_t* rowA = (const uint32_t*)(src + (size_t)top * srcStride);
+	const uint32_t* rowB = (const uint32_t*)(src + (size_t)std::min(top + 1, srcHeight - 1) * srcStride);
+
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i half = _mm_set1_epi16(128);
+	const __m128i weightA = _mm_set1_epi16((short)(256 - wy));
+	const __m128i weightB = _mm_set1_epi16((short)wy);
+	uint32_t* row = padded + 1;
+	for (int x = 0; x < width; x++) {
+		int l = columnLeft[x], r = columnRight[x];
+		// Left and right source pixels side by side, one channel per lane
+		__m128i a = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128((int)rowA[l]), _mm_cvtsi32_si128((int)rowA[r])), zero);
+		__m128i b = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128((int)rowB[l]), _mm_cvtsi32_si128((int)rowB[r])), zero);
+		// Blend vertically, then fold the right pixel onto the left
+		__m128i v = _mm_add_epi16(_mm_mullo_epi16(a, weightA), _mm_mullo_epi16(b, weightB));
+		v = _mm_srli_epi16(_mm_add_epi16(v, half), 8);
+		__m128i h = _mm_mullo_epi16(v, _mm_loadu_si128((const __m128i*)&columnWeights[x * 8]));
+		h = _mm_add_epi16(h, _mm_srli_si128(h, 8));
+		h = _mm_srli_epi16(_mm_add_epi16(h, half), 8);
+		row[x] = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(h, h));
+	}
+	padRow(padded, width);
+}
+
+//
+// FUNCTION: postProcessFrame
+//
+// PURPOSE: Scales src into dest and applies the enabled stages. Returns false if there is
+// nothing to draw.
+//
+bool postProcessFrame(const postSettings& s, const colorFilter& color,
+	const uint8_t* src, int srcWidth, int srcHeight, int srcStride,
+	uint8_t* dest, int destWidth, int destHeight, int destStride)
+{
+	if (srcWidth <= 0 || srcHeight <= 0 || destWidth <= 0 || destHeight <= 0) {
+		return false;
+	}
+
+	if (s.contrast > 0) {
+		measureContrast(src, srcWidth, srcHeight, srcStride, std::min(s.contrast, 1.0f));
+	}
+	stageParams params = makeParams(s, color);
+	rowFilter filter = selectChain(s);
+	rowFilter thicken = selectThicken(s);
+
+	mapColumns(srcWidth, destWidth);
+	for (int i = 0; i < 3; i++) {
+		scaledRows[i].resize(destWidth + ROW_PADDING);
+		thickRows[i].resize(destWidth + ROW_PADDING);
+	}
+
+	// Rows are produced in order, each pass running one row ahead of the pass that reads it.
+	// A ring of three is enough since only rows y - 1 to y + 1 are read for row y.
+	int scaled = 0, thickened = 0;
+	int last = destHeight - 1;
+	for (int y = 0; y < destHeight; y++) {
+		int needThick = std::min(y + 1, last);
+		int needScaled = thicken ? std::min(needThick + 1, last) : needThick;
+		for (; scaled <= needScaled; scaled++) {
+			scaleRow(src, srcHeight, srcStride, scaled, destHeight, scaledRows[scaled % 3].data(), destWidth);
+		}
+
+		std::vector<uint32_t>* input = scaledRows;
+		if (thicken) {
+			for (; thickened <= needThick; thickened++) {
+				uint32_t* out = thickRows[thickened % 3].data();
+				thicken(scaledRows[std::max(thickened - 1, 0) % 3].data() + 1,
+					scaledRows[thickened % 3].data() + 1,
+					scaledRows[std::min(thickened + 1, last) % 3].data() + 1,
+					out + 1, destWidth, params);
+				padRow(out, destWidth);
+			}
+			input = thickRows;
+		}
+
+		filter(input[std::max(y - 1, 0) % 3].data() + 1,
+			input[y % 3].data() + 1,
+			input[std::min(y + 1, last) % 3].data() + 1,
+			(uint32_t*)(dest + (size_t)y * destStride), destWidth, params);
+	}
+	return true;
+}
@@ -0,0 +1,191 @@
+#pragma once
+/*************************************************************************************************
+*
+* File: PostProcess.h
+*
+* Description: Optional low vision image stages applied to the magnified image after scaling:
+* text outline thickening, edge enhancement (unsharp mask), adaptive contrast stretching and
+* posterization, followed by the toolbar color filter.
+*
+* Each stage is a small struct with a static apply() that works on two 32bpp BGRA pixels at a
+* time, widened to 16 bits per channel in an SSE2 register. Enabled stages are strung together
+* at compile time by filterChain, so one pass over the image runs every stage on each pixel with
+* no per-pixel virtual calls. The chain for the current preset is picked once per frame.
+*
+* Stages that read neighbouring pixels see the input of the pass they run in, not the output of
+* earlier stages in the same pass. Thickening therefore runs as its own pass over the scaled
+* rows, and the unsharp mask is the only neighbourhood stage in the fused pass, so it sharpens
+* the thickened strokes.
+*
+*************************************************************************************************/
+
+#include <emmintrin.h>
+#include <stdint.h>
+
+// Post-processing values from the active preset. Zero turns a stage off.
+struct postSettings {
+	float sharpen = 0;	// edge enhancement amount (0 - 7.9)
+	float contrast = 0;	// adaptive contrast stretch strength (0 - 1)
+	int posterize = 0;	// levels per channel (2 - 8)
+	int outline = 0;	// 1 thickens dark text, -1 thickens light text
+};
+
+// Toolbar color filter, applied last since the magnifier's color effect doesn't reach our image
+struct colorFilter {
+	float factor[3] = { 1, 1, 1 };	// red, green, blue
+	float offset[3] = { 0, 0, 0 };
+};
+
+bool postProcessEnabled(const postSettings& s);
+
+// Clamps values read from a settings file to the ranges above.
+void clampPostSettings(postSettings& s);
+
+// Forgets the measured contrast bounds, so a new preset starts from the current image.
+void resetContrast();
+
+// Scales the 32bpp BGRA source image into dest and runs the enabled stages over it.
+bool postProcessFrame(const postSettings& s, const colorFilter& color,
+	const uint8_t* src, int srcWidth, int srcHeight, int srcStride,
+	uint8_t* dest, int destWidth, int destHeight, int destStride);
+
+// Per-frame constants, one 16 bit lane per channel for two pixels. The alpha lanes are set
+// so every stage leaves alpha unchanged.
+struct stageParams {
+	__m128i colorMask;		// all ones in the color lanes, zero in alpha
+	__m128i sharpen;		// amount * 4096
+	__m128i contrastLow;	// stretch lower bound
+	__m128i contrastScale;	// 255 / (high - low) * 512
+	__m128i levels;			// posterize levels - 1
+	__m128i levelScale;		// 510 (2 in alpha), multiplies the level index
+	__m128i levelRecip;		// 32768 / (levels - 1), turns the index back into a value
+	__m128i factor;			// color factor * 1024
+	__m128i offset;			// color offset * 255
+};
+
+// Cross-shaped neighbourhood of the two pixels being processed, read from the pass input.
+struct neighbours {
+	__m128i up, down, left, right;
+};
+
+//
+// Stages
+//
+
+// Darkens each pixel to the darkest of its neighbours, growing dark strokes by one pixel.
+struct thickenDarkStage {
+	static inline void apply(__m128i& px, const neighbours& n, const stageParams& p) {
+		__m128i m = _mm_min_epi16(_mm_min_epi16(n.up, n.down), _mm_min_epi16(n.left, n.right));
+		m = _mm_min_epi16(px, m);
+		px = _mm_or_si128(_mm_and_si128(p.colorMask, m), _mm_andnot_si128(p.colorMask, px));
+	}
+};
+
+// Brightens each pixel to the brightest of its neighbours, for light text on dark backgrounds.
+struct thickenLightStage {
+	static inline void apply(__m128i& px, const neighbours& n, const stageParams& p) {
+		__m128i m = _mm_max_epi16(_mm_max_epi16(n.up, n.down), _mm_max_epi16(n.left, n.right));
+		m = _mm_max_epi16(px, m);
+		px = _mm_or_si128(_mm_and_si128(p.colorMask, m), _mm_andnot_si128(p.colorMask, px));
+	}
+};
+
+// Unsharp mask: px + amount * (px - blur), where blur is the average of the four neighbours.
+struct sharpenStage {
+	static inline void apply(__m128i& px, const neighbours& n, const stageParams& p) {
+		__m128i sum = _mm_add_epi16(_mm_add_epi16(n.up, n.down), _mm_add_epi16(n.left, n.right));
+		// 16 * (px - blur), fits in 16 bits for 8 bit channels
+		__m128i diff = _mm_slli_epi16(_mm_sub_epi16(_mm_slli_epi16(px, 2), sum), 2);
+		px = _mm_add_epi16(px, _mm_mulhi_epi16(diff, p.sharpen));
+		px = _mm_min_epi16(_mm_max_epi16(px, _mm_setzero_si128()), _mm_set1_epi16(255));
+	}
+};
+
+// Stretches [low, high] of each channel to the full 0 - 255 range.
+struct contrastStage {
+	static inline void apply(__m128i& px, const neighbours&, const stageParams& p) {
+		__m128i v = _mm_slli_epi16(_mm_subs_epu16(px, p.contrastLow), 7);
+		px = _mm_min_epi16(_mm_mulhi_epu16(v, p.contrastScale), _mm_set1_epi16(255));
+	}
+};
+
+// Rounds each channel to the nearest of a few evenly spaced levels.
+struct posterizeStage {
+	static inline void apply(__m128i& px, const neighbours&, const stageParams& p) {
+		// idx = round(px * levels / 255), using x / 255 == (x + 1 + (x >> 8)) >> 8 for x < 65535
+		__m128i x = _mm_add_epi16(_mm_mullo_epi16(px, p.levels), _mm_set1_epi16(127));
+		__m128i idx = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+		// px = round(idx * 255 / levels): a rounded multiply-high by 32768 / levels
+		__m128i v = _mm_mullo_epi16(idx, p.levelScale);
+		px = _mm_add_epi16(_mm_mulhi_epu16(v, p.levelRecip), _mm_srli_epi16(_mm_mullo_epi16(v, p.levelRecip), 15));
+	}
+};
+
+// Toolbar color filter: px * factor + offset.
+struct colorStage {
+	static inline void apply(__m128i& px, const neighbours&, const stageParams& p) {
+		px = _mm_add_epi16(_mm_mulhi_epi16(_mm_slli_epi16(px, 6), p.factor), p.offset);
+		px = _mm_min_epi16(_mm_max_epi16(px, _mm_setzero_si128()), _mm_set1_epi16(255));
+	}
+};
+
+//
+// Compile-time chain
+//
+
+template <typename... Stages> struct stageList;
+
+template <> struct stageList<> {
+	static inline void apply(__m128i&, const neighbours&, const stageParams&) {}
+};
+
+template <typename First, typename... Rest> struct stageList<First, Rest...> {
+	static inline void apply(__m128i& px, const neighbours& n, const stageParams& p) {
+		First::apply(px, n, p);
+		stageList<Rest...>::apply(px, n, p);
+	}
+};
+
+// Runs one row through the stages. cur, up and down are scaled rows with one pixel of
+// padding on the left and at least five on the right, so every load is in bounds.
+typedef void (*rowFilter)(const uint32_t* up, const uint32_t* cur, const uint32_t* down,
+	uint32_t* out, int width, const stageParams& p);
+
+template <typename... Stages> struct filterChain {
+	// Two pixels per register half, four pixels per iteration.
+	static inline __m128i run4(const uint32_t* up, const uint32_t* cur, const uint32_t* down, const stageParams& p) {
+		const __m128i zero = _mm_setzero_si128();
+		__m128i c = _mm_loadu_si128((const __m128i*)cur);
+		__m128i u = _mm_loadu_si128((const __m128i*)up);
+		__m128i d = _mm_loadu_si128((const __m128i*)down);
+		__m128i l = _mm_loadu_si128((const __m128i*)(cur - 1));
+		__m128i r = _mm_loadu_si128((const __m128i*)(cur + 1));
+
+		neighbours lo = { _mm_unpacklo_epi8(u, zero), _mm_unpacklo_epi8(d, zero),
+			_mm_unpacklo_epi8(l, zero), _mm_unpacklo_epi8(r, zero) };
+		neighbours hi = { _mm_unpackhi_epi8(u, zero), _mm_unpackhi_epi8(d, zero),
+			_mm_unpackhi_epi8(l, zero), _mm_unpackhi_epi8(r, zero) };
+		__m128i pxLo = _mm_unpacklo_epi8(c, zero);
+		__m128i pxHi = _mm_unpackhi_epi8(c, zero);
+
+		stageList<Stages...>::apply(pxLo, lo, p);
+		stageList<Stages...>::apply(pxHi, hi, p);
+		return _mm_packus_epi16(pxLo, pxHi);
+	}
+
+	static void run(const uint32_t* up, const uint32_t* cur, const uint32_t* down,
+		uint32_t* out, int width, const stageParams& p) {
+		int x = 0;
+		for (; x + 4 <= width; x += 4) {
+			_mm_storeu_si128((__m128i*)(out + x), run4(up + x, cur + x, down + x, p));
+		}
+		if (x < width) {
+			// Padding keeps the loads valid; only copy back the pixels that exist.
+			uint32_t tail[4];
+			_mm_storeu_si128((__m128i*)tail, run4(up + x, cur + x, down + x, p));
+			for (int i = 0; x + i < width; i++) {
+				out[x + i] = tail[i];
+			}
+		}
+	}
+};